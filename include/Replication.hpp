@@ -0,0 +1,67 @@
+#ifndef SWIFTYSYNC_REPLICATION_H
+#define SWIFTYSYNC_REPLICATION_H
+
+#include <string>
+#include <string_view>
+
+#define REPLICA_AUTH_PREFIX "REPLICA_AUTH"
+#define REPLICATION_PREFIX "REPLICATION"
+#define REPLICATION_TOPIC "replication"
+#define REPLICATION_ROUTE "/replication"
+
+#define REPLICATION_WRITE "write"
+#define REPLICATION_SNAPSHOT_BEGIN "snapshot_begin"
+#define REPLICATION_SNAPSHOT "snapshot"
+#define REPLICATION_SNAPSHOT_END "snapshot_end"
+
+#define REPLICATION_MAX_MESSAGE (64 * 1024 * 1024)
+// Snapshot pauses above this buffered amount and resumes from .drain
+#define REPLICATION_SNAPSHOT_BACKPRESSURE (1024 * 1024)
+// Only for sockets on REPLICATION_ROUTE; client sockets keep uWS's default
+#define REPLICATION_MAX_BACKPRESSURE (16 * 1024 * 1024)
+
+enum class ReplicationRole {
+	standalone,
+	primary,
+	replica
+};
+
+/*
+ Primary streams every applied documentSet/fieldSet to connected replicas.
+ Replica connects to the primary, loads a snapshot of all documents, drops
+ documents the snapshot didn't mention, then applies the stream and serves
+ only documentGet/fieldGet requests. Both sides must declare the same
+ collections.
+*/
+struct ReplicationBehavior {
+	ReplicationRole role = ReplicationRole::standalone;
+	std::string key;
+
+	std::string primaryAddress = "localhost";
+	int primaryPort = 0;
+	std::string caFilename;
+	unsigned reconnectInterval = 1000;
+	// Seconds without any frame from the primary, longer than uWS's 120 s ping interval
+	unsigned readTimeout = 180;
+};
+
+enum class ReplicationEntryType {
+	write,
+	snapshotBegin,
+	snapshot,
+	snapshotEnd
+};
+
+struct ReplicationEntry {
+	ReplicationEntryType type = ReplicationEntryType::write;
+	unsigned long long sequence = 0;
+	std::string collectionName;
+	std::string documentName;
+	std::string content;
+
+	std::string serialize();
+
+	static bool parse(std::string_view message, ReplicationEntry& entry);
+};
+
+#endif
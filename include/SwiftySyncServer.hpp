@@ -13,11 +13,13 @@
 #include <UUID.hpp>
 #include <Request.hpp>
 #include <Functions.hpp>
+#include <Replication.hpp>
 #include <vector>
 #include <string>
 #include <functional>
 #include <fstream>
 #include <map>
+#include <set>
 #ifdef __cpp_lib__filesystem
 #include <filesystem>
 namespace fs = std::filesystem;
@@ -36,6 +38,11 @@ class ConnectionData {
 public:
 	std::string connectionId;
 	std::string userId;
+	bool isReplica = false;
+	bool isSnapshotting = false;
+	size_t snapshotCollection = 0;
+	size_t snapshotDocument = 0;
+	unsigned long long snapshotCount = 0;
 };
 
 bool isDataRequest(Request* request);
@@ -86,6 +93,10 @@ public:
 	ServerBehavior behavior;
 
 	SecurityRule rule;
+
+	ReplicationBehavior replication;
+	unsigned long long replicationSequence = 0;
+	bool replicaSynced = false;
 	
 	Collection* operator [](std::string name);
 
@@ -113,6 +124,22 @@ public:
 
 	void sendData(std::string userId, DataUnit data);
 
+	bool isReadOnly();
+
+	void subscribeReplica(WebSocket ws, std::string key);
+
+	bool sendReplicationEntry(WebSocket ws, ReplicationEntry entry);
+
+	void streamSnapshot(WebSocket ws);
+
+	void replicate(WebSocket ws, Document* document);
+
+	void applyReplicationEntry(ReplicationEntry entry);
+
+	void finishSnapshot(std::map<std::string, std::set<std::string>> documentNames);
+
+	void startReplica();
+
 	void run(RunBehavior runBehavior);
 
 	SwiftyServer(std::string address, int port, ServerBehavior behavior) {
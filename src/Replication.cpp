@@ -0,0 +1,659 @@
+#define SERVER
+#include <SwiftySyncServer.hpp>
+#include <Replication.hpp>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <memory>
+#if !(defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__))
+#include <csignal>
+#include <cerrno>
+#include <cstring>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <unistd.h>
+#endif
+#ifdef SSL_SERVER
+#include <openssl/ssl.h>
+#include <openssl/x509_vfy.h>
+#include <openssl/err.h>
+#endif
+
+using namespace std;
+
+
+/*
+ Every field is written as <length>:<bytes>, so collection and document
+ names chosen by clients can't break the framing.
+*/
+static void appendField(string& message, const string& field) {
+    message += to_string(field.size());
+    message += ':';
+    message += field;
+}
+
+static bool readField(string_view& message, string& field) {
+    auto separator = message.find(':');
+    if (separator == string_view::npos || separator == 0 || separator > 20) {
+        return false;
+    }
+    unsigned long long length = 0;
+    for (size_t i = 0; i < separator; i++) {
+        if (message[i] < '0' || message[i] > '9') {
+            return false;
+        }
+        length = length * 10 + (message[i] - '0');
+    }
+    message.remove_prefix(separator + 1);
+    if (length > message.size()) {
+        return false;
+    }
+    field = string(message.substr(0, length));
+    message.remove_prefix(length);
+    return true;
+}
+
+string ReplicationEntry::serialize() {
+    string message = REPLICATION_PREFIX;
+    if (type == ReplicationEntryType::write) {
+        appendField(message, REPLICATION_WRITE);
+    }
+    else if (type == ReplicationEntryType::snapshotBegin) {
+        appendField(message, REPLICATION_SNAPSHOT_BEGIN);
+    }
+    else if (type == ReplicationEntryType::snapshot) {
+        appendField(message, REPLICATION_SNAPSHOT);
+    }
+    else {
+        appendField(message, REPLICATION_SNAPSHOT_END);
+    }
+    appendField(message, to_string(sequence));
+    appendField(message, collectionName);
+    appendField(message, documentName);
+    appendField(message, content);
+    return message;
+}
+
+bool ReplicationEntry::parse(string_view message, ReplicationEntry& entry) {
+    if (message.find(REPLICATION_PREFIX) != 0) {
+        return false;
+    }
+    message.remove_prefix(strlen(REPLICATION_PREFIX));
+    string fields[5];
+    for (int i = 0; i < 5; i++) {
+        if (!readField(message, fields[i])) {
+            return false;
+        }
+    }
+    if (!message.empty()) {
+        return false;
+    }
+    if (fields[0] == REPLICATION_WRITE) {
+        entry.type = ReplicationEntryType::write;
+    }
+    else if (fields[0] == REPLICATION_SNAPSHOT_BEGIN) {
+        entry.type = ReplicationEntryType::snapshotBegin;
+    }
+    else if (fields[0] == REPLICATION_SNAPSHOT) {
+        entry.type = ReplicationEntryType::snapshot;
+    }
+    else if (fields[0] == REPLICATION_SNAPSHOT_END) {
+        entry.type = ReplicationEntryType::snapshotEnd;
+    }
+    else {
+        return false;
+    }
+    try {
+        entry.sequence = stoull(fields[1]);
+    }
+    catch (...) {
+        return false;
+    }
+    entry.collectionName = fields[2];
+    entry.documentName = fields[3];
+    entry.content = fields[4];
+    return true;
+}
+
+// Takes the same time for every key of the expected length
+static bool isSameKey(const string& key, const string& expected) {
+    size_t difference = key.size() ^ expected.size();
+    for (size_t i = 0; i < expected.size(); i++) {
+        char symbol = i < key.size() ? key[i] : 0;
+        difference |= (unsigned char)(symbol ^ expected[i]);
+    }
+    return difference == 0;
+}
+
+bool SwiftyServer::isReadOnly() {
+    return replication.role == ReplicationRole::replica;
+}
+
+void SwiftyServer::subscribeReplica(WebSocket ws, string key) {
+    ConnectionData* data = (ConnectionData*)ws->getUserData();
+    if (replication.role != ReplicationRole::primary || replication.key.empty() || !isSameKey(key, replication.key)) {
+        cout << "Replica rejected\n";
+        ws->end(1008, "Replica rejected");
+        return;
+    }
+    data->isReplica = true;
+    data->isSnapshotting = true;
+    data->snapshotCollection = 0;
+    data->snapshotDocument = 0;
+    data->snapshotCount = 0;
+    ws->subscribe(REPLICATION_TOPIC);
+    cout << "Replica " << data->connectionId << " subscribed\n";
+
+    ReplicationEntry begin;
+    begin.type = ReplicationEntryType::snapshotBegin;
+    begin.sequence = replicationSequence;
+    if (sendReplicationEntry(ws, begin)) {
+        streamSnapshot(ws);
+    }
+}
+
+bool SwiftyServer::sendReplicationEntry(WebSocket ws, ReplicationEntry entry) {
+    if (ws->send(entry.serialize()) == std::remove_pointer_t<WebSocket>::DROPPED) {
+        ConnectionData* data = (ConnectionData*)ws->getUserData();
+        data->isSnapshotting = false;
+        cout << "Replica " << data->connectionId << " fell behind\n";
+        ws->end(1013, "Replica fell behind");
+        return false;
+    }
+    return true;
+}
+
+/*
+ Sends documents until the socket buffers REPLICATION_SNAPSHOT_BACKPRESSURE
+ bytes; .drain calls this again to continue from the cursor in ConnectionData.
+ Writes published meanwhile reach the replica in order with the snapshot.
+*/
+void SwiftyServer::streamSnapshot(WebSocket ws) {
+    ConnectionData* data = (ConnectionData*)ws->getUserData();
+    while (data->isSnapshotting && ws->getBufferedAmount() < REPLICATION_SNAPSHOT_BACKPRESSURE) {
+        if (data->snapshotCollection >= collections.size()) {
+            data->isSnapshotting = false;
+            ReplicationEntry end;
+            end.type = ReplicationEntryType::snapshotEnd;
+            end.sequence = replicationSequence;
+            end.content = to_string(data->snapshotCount);
+            sendReplicationEntry(ws, end);
+            return;
+        }
+        auto& collection = collections[data->snapshotCollection];
+        if (data->snapshotDocument >= collection.documents.size()) {
+            data->snapshotCollection++;
+            data->snapshotDocument = 0;
+            continue;
+        }
+        auto& document = collection.documents[data->snapshotDocument++];
+        JSONEncoder encoder;
+        auto container = encoder.container();
+        container.encode(document.fields);
+        ReplicationEntry entry;
+        entry.type = ReplicationEntryType::snapshot;
+        entry.sequence = replicationSequence;
+        entry.collectionName = collection.name;
+        entry.documentName = document.name;
+        entry.content = container.content;
+        if (!sendReplicationEntry(ws, entry)) {
+            return;
+        }
+        data->snapshotCount++;
+    }
+}
+
+void SwiftyServer::replicate(WebSocket ws, Document* document) {
+    if (replication.role != ReplicationRole::primary) {
+        return;
+    }
+    JSONEncoder encoder;
+    auto container = encoder.container();
+    container.encode(document->fields);
+    ReplicationEntry entry;
+    entry.type = ReplicationEntryType::write;
+    entry.sequence = ++replicationSequence;
+    entry.collectionName = document->collection->name;
+    entry.documentName = document->name;
+    entry.content = container.content;
+    ws->publish(REPLICATION_TOPIC, entry.serialize());
+}
+
+void SwiftyServer::applyReplicationEntry(ReplicationEntry entry) {
+    auto collection = operator[](entry.collectionName);
+    if (collection == nullptr) {
+        cout << "Replication: unknown collection " << entry.collectionName << "\n";
+        return;
+    }
+    collection->createDocument(entry.documentName);
+    auto doc = collection->operator[](entry.documentName);
+    JSONDecoder decoder;
+    auto container = decoder.container(entry.content);
+    doc->fields = container.decode(vector<Field>());
+    doc->save();
+}
+
+void SwiftyServer::finishSnapshot(map<string, set<string>> documentNames) {
+    for (auto& collection : collections) {
+        auto& names = documentNames[collection.name];
+        for (int i = (int)collection.documents.size() - 1; i >= 0; i--) {
+            if (names.count(collection.documents[i].name) == 0) {
+                fs::remove(collection.documents[i].documentUrl());
+                collection.documents.erase(collection.documents.begin() + i);
+            }
+        }
+    }
+    replicaSynced = true;
+}
+
+#if !(defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__))
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+namespace {
+
+class ReplicaConnection {
+public:
+    ~ReplicaConnection() {
+        close();
+    }
+
+    bool open(const ReplicationBehavior& behavior) {
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* addresses = nullptr;
+        int resolved = getaddrinfo(behavior.primaryAddress.c_str(), to_string(behavior.primaryPort).c_str(), &hints, &addresses);
+        if (resolved != 0) {
+            cout << "Replica can't resolve " << behavior.primaryAddress << ": " << gai_strerror(resolved) << "\n";
+            return false;
+        }
+        for (auto address = addresses; address != nullptr; address = address->ai_next) {
+            fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+            if (fd < 0) {
+                continue;
+            }
+            if (connect(fd, address->ai_addr, address->ai_addrlen) == 0) {
+                break;
+            }
+            ::close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(addresses);
+        if (fd < 0) {
+            cout << "Replica can't connect to " << behavior.primaryAddress << ":" << behavior.primaryPort << ": " << strerror(errno) << "\n";
+            return false;
+        }
+        timeval timeout = {};
+        timeout.tv_sec = behavior.readTimeout;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        int enabled = 1;
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &enabled, sizeof(enabled));
+#ifdef SO_NOSIGPIPE
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &enabled, sizeof(enabled));
+#endif
+#ifdef SSL_SERVER
+        context = SSL_CTX_new(TLS_client_method());
+        if (context == nullptr) {
+            cout << "Replica can't create a TLS context\n";
+            return false;
+        }
+        if (behavior.caFilename.empty()) {
+            SSL_CTX_set_default_verify_paths(context);
+        }
+        else if (SSL_CTX_load_verify_locations(context, behavior.caFilename.c_str(), nullptr) != 1) {
+            cout << "Replica can't load " << behavior.caFilename << "\n";
+            return false;
+        }
+        else {
+            // caFilename may pin the primary's own leaf certificate rather than its CA
+            X509_VERIFY_PARAM_set_flags(SSL_CTX_get0_param(context), X509_V_FLAG_PARTIAL_CHAIN);
+        }
+        SSL_CTX_set_verify(context, SSL_VERIFY_PEER, nullptr);
+        ssl = SSL_new(context);
+        if (ssl == nullptr) {
+            return false;
+        }
+        SSL_set_fd(ssl, fd);
+        SSL_set_tlsext_host_name(ssl, behavior.primaryAddress.c_str());
+        SSL_set1_host(ssl, behavior.primaryAddress.c_str());
+        if (SSL_connect(ssl) != 1) {
+            auto verifyResult = SSL_get_verify_result(ssl);
+            cout << "Replica TLS handshake with primary failed: ";
+            if (verifyResult != X509_V_OK) {
+                cout << X509_verify_cert_error_string(verifyResult) << "\n";
+            }
+            else {
+                char error[256];
+                ERR_error_string_n(ERR_get_error(), error, sizeof(error));
+                cout << error << "\n";
+            }
+            return false;
+        }
+#endif
+        return true;
+    }
+
+    bool write(const string& data) {
+        size_t sent = 0;
+        while (sent < data.size()) {
+#ifdef SSL_SERVER
+            int result = SSL_write(ssl, data.data() + sent, (int)(data.size() - sent));
+#else
+            auto result = ::send(fd, data.data() + sent, data.size() - sent, SEND_FLAGS);
+#endif
+            if (result <= 0) {
+                return false;
+            }
+            sent += result;
+        }
+        return true;
+    }
+
+    bool read(char* buffer, size_t size) {
+        size_t received = 0;
+        while (received < size) {
+#ifdef SSL_SERVER
+            int result = SSL_read(ssl, buffer + received, (int)(size - received));
+#else
+            auto result = ::recv(fd, buffer + received, size - received, 0);
+#endif
+            if (result <= 0) {
+                return false;
+            }
+            received += result;
+        }
+        return true;
+    }
+
+    void close() {
+#ifdef SSL_SERVER
+        if (ssl != nullptr) {
+            SSL_free(ssl);
+            ssl = nullptr;
+        }
+        if (context != nullptr) {
+            SSL_CTX_free(context);
+            context = nullptr;
+        }
+#endif
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+private:
+    int fd = -1;
+#ifdef SSL_SERVER
+    SSL_CTX* context = nullptr;
+    SSL* ssl = nullptr;
+#endif
+};
+
+class ReplicaClient {
+public:
+    ReplicaClient(SwiftyServer* server, uWS::Loop* loop) {
+        this->server = server;
+        this->loop = loop;
+        this->behavior = server->replication;
+    }
+
+    void run() {
+        while (true) {
+            ReplicaConnection connection;
+            if (connection.open(behavior) && handshake(connection)) {
+                if (sendFrame(connection, 0x1, REPLICA_AUTH_PREFIX + behavior.key)) {
+                    cout << "Replica connected to " << behavior.primaryAddress << ":" << behavior.primaryPort << "\n";
+                    stream(connection);
+                }
+                else {
+                    cout << "Replica can't send its key to primary\n";
+                }
+            }
+            cout << "Replica reconnecting in " << behavior.reconnectInterval << " ms\n";
+            this_thread::sleep_for(chrono::milliseconds(behavior.reconnectInterval));
+        }
+    }
+
+private:
+    SwiftyServer* server;
+    uWS::Loop* loop;
+    ReplicationBehavior behavior;
+    random_device random;
+
+    string createKey() {
+        const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        unsigned char bytes[18] = {};
+        for (int i = 0; i < 16; i++) {
+            bytes[i] = random() & 0xFF;
+        }
+        string key;
+        for (int i = 0; i < 18; i += 3) {
+            unsigned value = (bytes[i] << 16) | (bytes[i + 1] << 8) | bytes[i + 2];
+            key += alphabet[(value >> 18) & 0x3F];
+            key += alphabet[(value >> 12) & 0x3F];
+            key += alphabet[(value >> 6) & 0x3F];
+            key += alphabet[value & 0x3F];
+        }
+        key.resize(22);
+        return key + "==";
+    }
+
+    bool handshake(ReplicaConnection& connection) {
+        string request = "GET " REPLICATION_ROUTE " HTTP/1.1\r\n";
+        request += "Host: " + behavior.primaryAddress + ":" + to_string(behavior.primaryPort) + "\r\n";
+        request += "Upgrade: websocket\r\n";
+        request += "Connection: Upgrade\r\n";
+        request += "Sec-WebSocket-Key: " + createKey() + "\r\n";
+        request += "Sec-WebSocket-Version: 13\r\n\r\n";
+        if (!connection.write(request)) {
+            cout << "Replica can't send the WebSocket upgrade\n";
+            return false;
+        }
+        string response;
+        char symbol;
+        while (response.size() < 8192 && response.find("\r\n\r\n") == string::npos) {
+            if (!connection.read(&symbol, 1)) {
+                cout << "Replica lost connection during the WebSocket upgrade\n";
+                return false;
+            }
+            response += symbol;
+        }
+        if (response.find("HTTP/1.1 101") != 0) {
+            cout << "Primary refused the WebSocket upgrade: " << response.substr(0, response.find("\r\n")) << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    bool sendFrame(ReplicaConnection& connection, unsigned char opCode, const string& payload) {
+        string frame;
+        frame += (char)(0x80 | opCode);
+        uint64_t size = payload.size();
+        if (size < 126) {
+            frame += (char)(0x80 | size);
+        }
+        else if (size <= 0xFFFF) {
+            frame += (char)(0x80 | 126);
+            frame += (char)((size >> 8) & 0xFF);
+            frame += (char)(size & 0xFF);
+        }
+        else {
+            frame += (char)(0x80 | 127);
+            for (int i = 7; i >= 0; i--) {
+                frame += (char)((size >> (8 * i)) & 0xFF);
+            }
+        }
+        char mask[4];
+        for (int i = 0; i < 4; i++) {
+            mask[i] = random() & 0xFF;
+        }
+        frame.append(mask, 4);
+        for (size_t i = 0; i < payload.size(); i++) {
+            frame += (char)(payload[i] ^ mask[i % 4]);
+        }
+        return connection.write(frame);
+    }
+
+    bool readMessage(ReplicaConnection& connection, string& message) {
+        message.clear();
+        while (true) {
+            unsigned char header[2];
+            if (!connection.read((char*)header, 2)) {
+                cout << "Replica lost connection to primary\n";
+                return false;
+            }
+            bool fin = header[0] & 0x80;
+            unsigned char opCode = header[0] & 0x0F;
+            uint64_t size = header[1] & 0x7F;
+            if (size >= 126) {
+                unsigned char extended[8];
+                int length = size == 126 ? 2 : 8;
+                if (!connection.read((char*)extended, length)) {
+                    return false;
+                }
+                size = 0;
+                for (int i = 0; i < length; i++) {
+                    size = (size << 8) | extended[i];
+                }
+            }
+            char mask[4] = {};
+            bool masked = header[1] & 0x80;
+            if (masked && !connection.read(mask, 4)) {
+                return false;
+            }
+            if (size > REPLICATION_MAX_MESSAGE - message.size()) {
+                cout << "Replica received an oversized frame\n";
+                return false;
+            }
+            string payload(size, '\0');
+            if (size > 0 && !connection.read(payload.data(), size)) {
+                return false;
+            }
+            if (masked) {
+                for (size_t i = 0; i < payload.size(); i++) {
+                    payload[i] ^= mask[i % 4];
+                }
+            }
+            if (opCode == 0x8) {
+                cout << "Primary closed the connection";
+                if (payload.size() >= 2) {
+                    cout << ": " << (((unsigned char)payload[0] << 8) | (unsigned char)payload[1]) << " " << payload.substr(2);
+                }
+                cout << "\n";
+                return false;
+            }
+            if (opCode == 0x9) {
+                if (!sendFrame(connection, 0xA, payload)) {
+                    return false;
+                }
+                continue;
+            }
+            if (opCode == 0xA) {
+                continue;
+            }
+            message += payload;
+            if (fin) {
+                return true;
+            }
+        }
+    }
+
+    void stream(ReplicaConnection& connection) {
+        bool snapshotting = false;
+        bool synced = false;
+        unsigned long long sequence = 0;
+        unsigned long long received = 0;
+        map<string, set<string>> documentNames;
+        string message;
+        while (readMessage(connection, message)) {
+            ReplicationEntry entry;
+            if (!ReplicationEntry::parse(message, entry)) {
+                continue;
+            }
+            SwiftyServer* server = this->server;
+            if (entry.type == ReplicationEntryType::snapshotBegin) {
+                if (snapshotting || synced) {
+                    cout << "Replica got an unexpected snapshot_begin\n";
+                    return;
+                }
+                snapshotting = true;
+                sequence = entry.sequence;
+                continue;
+            }
+            if (entry.type == ReplicationEntryType::snapshotEnd) {
+                if (!snapshotting || to_string(received) != entry.content || entry.sequence != sequence) {
+                    cout << "Replica snapshot is incomplete\n";
+                    return;
+                }
+                snapshotting = false;
+                synced = true;
+                cout << "Replica synced " << received << " documents\n";
+                loop->defer([server, documentNames]() {
+                    server->finishSnapshot(documentNames);
+                });
+                documentNames.clear();
+                continue;
+            }
+            if (entry.type == ReplicationEntryType::snapshot) {
+                if (!snapshotting) {
+                    cout << "Replica got a snapshot document outside a snapshot\n";
+                    return;
+                }
+                received++;
+            }
+            if (entry.type == ReplicationEntryType::write) {
+                if ((!snapshotting && !synced) || entry.sequence != sequence + 1) {
+                    cout << "Replica missed write " << sequence + 1 << "\n";
+                    return;
+                }
+                sequence = entry.sequence;
+            }
+            if (snapshotting) {
+                documentNames[entry.collectionName].insert(entry.documentName);
+            }
+            loop->defer([server, entry]() {
+                server->applyReplicationEntry(entry);
+            });
+        }
+    }
+};
+
+}
+
+void SwiftyServer::startReplica() {
+    if (replication.primaryPort == 0) {
+        cout << "Replica has no primary to follow\n";
+        return;
+    }
+    if (replication.key.empty()) {
+        cout << "Replica has no replication key\n";
+        return;
+    }
+    auto client = make_shared<ReplicaClient>(this, uWS::Loop::get());
+    thread([client]() {
+        // SSL_write can't pass MSG_NOSIGNAL, so keep SIGPIPE away from this thread only
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+        client->run();
+    }).detach();
+}
+
+#else
+
+void SwiftyServer::startReplica() {
+    cout << "Replication is not supported on this platform\n";
+}
+
+#endif
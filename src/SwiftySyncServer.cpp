@@ -90,6 +90,20 @@ void SwiftyServer::handleDataRequest(WebSocket ws, DataRequest* request) {
         ws->send(respond + DATA_REQUEST_FAILURE);
         return;
     }
+    if (isReadOnly() && (!replicaSynced || request->type == RequestType::documentSet || request->type == RequestType::fieldSet)) {
+        ws->send(respond + DATA_REQUEST_FAILURE);
+        return;
+    }
+    if (isReadOnly() && !collection->isDocumentNameTaken(request->documentName)) {
+        if (request->type == RequestType::documentGet) {
+            JSONEncoder encoder;
+            auto container = encoder.container();
+            container.encode(vector<Field>());
+            respond += container.content;
+        }
+        ws->send(respond);
+        return;
+    }
     collection->createDocument(request->documentName);
     auto doc = collection->operator[](request->documentName);
     if (request->type == RequestType::documentGet) {
@@ -105,6 +119,7 @@ void SwiftyServer::handleDataRequest(WebSocket ws, DataRequest* request) {
         doc->fields = fields;
         respond += DATA_SET_SUCCESSFUL;
         doc->save();
+        replicate(ws, doc);
     }
     if (request->type == RequestType::fieldGet) {
         JSONEncoder encoder;
@@ -155,6 +170,7 @@ void SwiftyServer::handleDataRequest(WebSocket ws, DataRequest* request) {
         }
         respond += FIELD_SET_SUCCESSFUL;
         doc->save();
+        replicate(ws, doc);
     }
     ws->send(respond);
 }
@@ -306,8 +322,37 @@ void SwiftyServer::run(RunBehavior runBehavior) {
             ConnectionData* data = (ConnectionData*)ws->getUserData();
             ws->unsubscribe("broadcast");
         }
-    }).listen(port, [this, runBehavior](auto* token) {
+    });
+    if (replication.role == ReplicationRole::primary) {
+        app.ws<ConnectionData>(REPLICATION_ROUTE, {
+            .maxBackpressure = REPLICATION_MAX_BACKPRESSURE,
+            .open = [this](auto* ws) {
+                ConnectionData* data = (ConnectionData*)ws->getUserData();
+                data->connectionId = create_uuid();
+            }, .message = [this](auto* ws, string_view message, uWS::OpCode opCode) {
+                ConnectionData* data = (ConnectionData*)ws->getUserData();
+                if (!data->isReplica && message.find(REPLICA_AUTH_PREFIX) == 0) {
+                    message.remove_prefix(strlen(REPLICA_AUTH_PREFIX));
+                    subscribeReplica(ws, string(message));
+                }
+            }, .drain = [this](auto* ws) {
+                ConnectionData* data = (ConnectionData*)ws->getUserData();
+                if (data->isSnapshotting) {
+                    streamSnapshot(ws);
+                }
+            }, .close = [this](auto* ws, int code, string_view message) {
+                ConnectionData* data = (ConnectionData*)ws->getUserData();
+                if (data->isReplica) {
+                    ws->unsubscribe(REPLICATION_TOPIC);
+                }
+            }
+        });
+    }
+    app.listen(port, [this, runBehavior](auto* token) {
         behavior.completion(token);
+        if (token && replication.role == ReplicationRole::replica) {
+            startReplica();
+        }
         runBehavior.afterStart();
     }).run();
 }
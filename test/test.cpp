@@ -1,8 +1,8 @@
 #define SERVER
-#define SSL_SERVER
 
 #include <SwiftySyncServer.hpp>
 #include <iostream>
+#include <cstdlib>
 #include <Authorization.hpp>
 #include <GoogleAuthorization.hpp>
 #include <FacebookAuthorization.hpp>
@@ -32,8 +32,17 @@ class DebugProvider : public AuthorizationProvider {
 	}
 };
 
-int main() {
-	int port = 8888;
+int main(int argc, char** argv) {
+	int primaryPort = 8888;
+	bool isReplica = argc > 1 && std::string(argv[1]) == "replica";
+	int port = primaryPort;
+	if (isReplica) {
+		if (argc < 3 || std::atoi(argv[2]) <= 0 || std::atoi(argv[2]) == primaryPort) {
+			std::cout << "Usage: test_server replica <port other than " << primaryPort << ">\n";
+			return 1;
+		}
+		port = std::atoi(argv[2]);
+	}
 	SwiftyServer server("localhost", port, {
 		.completion = [port](bool started) {
 			if (started) {
@@ -66,6 +75,32 @@ int main() {
 		Collection(&server, "privileges")
 	};
 
+	// Configure with -DREPLICATION_KEY=<secret>, then run `test_server` and `test_server replica 8889`
+#ifdef REPLICATION_KEY
+	if (isReplica) {
+		server.serverUrl = "replica-" + std::to_string(port) + "/";
+		fs::create_directory(server.serverUrl);
+		server.replication = {
+			.role = ReplicationRole::replica,
+			.key = REPLICATION_KEY,
+			.primaryAddress = "localhost",
+			.primaryPort = primaryPort,
+			.caFilename = "certificate.pem"
+		};
+	}
+	else {
+		server.replication = {
+			.role = ReplicationRole::primary,
+			.key = REPLICATION_KEY
+		};
+	}
+#else
+	if (isReplica) {
+		std::cout << "Define REPLICATION_KEY at build time to run a replica\n";
+		return 1;
+	}
+#endif
+
 	auto googleProvider = GoogleProvider(GOOGLE_CLIENT_ID);
 	auto castedGoogleProvider = (AuthorizationProvider*) static_cast<AuthorizationProvider*>(&googleProvider);
 	